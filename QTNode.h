@@ -1,15 +1,97 @@
-
+#include <atomic>
 #include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <new>
 #include <vector>
 #include "Vertex.h"
 using namespace std;
 
+// the entries of a leaf, held in one block sized to them so that stems
+// and empty leaves don't carry any. The header is followed by the data
+// of the exact and then the quantized entries, the exact entries'
+// vertices, the quantized entries' x and y offsets and, once the leaf
+// holds a vertex that can expire, every entry's timestamp
+template <class T>
+struct QTBucket{
+
+	unsigned exact, packed;
+
+	// 16 bit words per quantized entry
+	unsigned char words;
+
+	// log2 of the width, in steps of the leaf's grid, of the grid cell
+	// each quantized entry stands for
+	signed char level;
+
+	bool timed;
+
+	T* data (){ return (T*)((char*)this + layout (exact, packed, words, 0)); }
+	vertex* points (){ return (vertex*)((char*)this + layout (exact, packed, words, 1)); }
+	unsigned short* codes (){ return (unsigned short*)((char*)this + layout (exact, packed, words, 2)); }
+	double* times (){ return (double*)((char*)this + layout (exact, packed, words, 3)); }
+
+	// offset of the given section, or the block's size at part 4
+	static size_t layout (unsigned exact, unsigned packed, unsigned words, int part){
+		size_t at = align (sizeof (QTBucket), alignof (T));
+		if (part > 0){ at = align (at + (exact + packed) * sizeof (T), alignof (vertex)); }
+		if (part > 1){ at += exact * sizeof (vertex); }
+		if (part > 2){ at = align (at + packed * words * sizeof (unsigned short), alignof (double)); }
+		if (part > 3){ at += (exact + packed) * sizeof (double); }
+		return at;
+	}
+	static size_t align (size_t at, size_t to){ return (at + to - 1) / to * to; }
+
+	// a block for the given number of entries holding the entries of b
+	// (if any), but the one at skip, at the front of each section. The
+	// rest is left for the caller to fill in, the data by placement new
+	static QTBucket* resize (QTBucket* b, unsigned exact, unsigned packed, unsigned words, bool timed, unsigned skip = -1){
+		QTBucket* r = (QTBucket*)::operator new (layout (exact, packed, words, timed ? 4 : 3));
+		r->exact = exact;
+		r->packed = packed;
+		r->words = words;
+		r->level = b ? b->level : 0;
+		r->timed = timed;
+		for (unsigned i=0, e=0, p=0; b && i < b->exact + b->packed; ++i){
+			if (i == skip){
+				continue;
+			}
+			unsigned j = (i < b->exact) ? e++ : exact + p++;
+			new (&r->data()[j]) T (b->data()[i]);
+			if (i < b->exact){
+				r->points()[j] = b->points()[i];
+			}
+			else{
+				memcpy (&r->codes()[(j-exact)*words], &b->codes()[(i-b->exact)*words], words*sizeof (unsigned short));
+			}
+			if (timed){
+				r->times()[j] = b->timed ? b->times()[i] : numeric_limits<double>::infinity();
+			}
+		}
+		return r;
+	}
+
+	static void destroy (QTBucket* b){
+		if (b){
+			for (unsigned i=0; i < b->exact + b->packed; ++i){
+				b->data()[i].~T();
+			}
+			::operator delete (b);
+		}
+	}
+};
+
+// oldest and newest timestamps below a node
+struct QTTimes{
+	double minTime, maxTime;
+};
+
 template <class T>
 class QTNode{
 	
 	public:
 		
-		QTNode <T>(vertex newCenter, vertex newRange){ 
+		QTNode <T>(vertex newCenter, vertex newRange, const T& newTotal){ 
 			child[0] = NULL;
 			child[1] = NULL;
 			child[2] = NULL; 
@@ -17,16 +99,65 @@ class QTNode{
 			center = newCenter;
 			range = newRange;
 			leaf = true;
+			refs = 1;
+			count = 0;
+			total = newTotal;
+			sumX = 0;
+			sumY = 0;
+			bucket = NULL;
+			times = NULL;
+		}
+		// shallow copy used for path copying, the children are shared
+		QTNode <T>(const QTNode <T>& node){
+			for (int i=0; i < 4; ++i){
+				child[i] = node.child[i];
+				if (child[i]){child[i]->refs++;}
+			}
+			center = node.center;
+			range = node.range;
+			leaf = node.leaf;
+			bucket = node.bucket ? QTBucket <T>::resize (node.bucket, node.bucket->exact, node.bucket->packed, node.bucket->words, node.bucket->timed) : NULL;
+			refs = 1;
+			count = node.count;
+			total = node.total;
+			sumX = node.sumX;
+			sumY = node.sumY;
+			times = node.times ? new QTTimes (*node.times) : NULL;
 		}
-		~QTNode (){ for (int i=0; i < 4; ++i) if (child[i]){delete child[i];}}
+		~QTNode (){ for (int i=0; i < 4; ++i) release (child[i]); QTBucket <T>::destroy (bucket); delete times;}
+
+		// drop one reference, the last one frees the node and its subtree
+		static void release (QTNode* node){ if (node && --node->refs == 0){delete node;}}
+
+		// oldest and newest timestamps in this subtree, a vertex inserted
+		// without one never expires and counts as infinitely new
+		double minTime () const { return times ? times->minTime : numeric_limits<double>::infinity(); }
+		double maxTime () const { return times ? times->maxTime : (count > 0 ? numeric_limits<double>::infinity() : -numeric_limits<double>::infinity()); }
 
 		vertex center, range;
 
-		// used by stem nodes
+		// number of trees and parent nodes sharing this node
+		atomic <unsigned> refs;
+
+		// number of vertices in this subtree and their data
+		// folded together with the tree's combine function
+		unsigned count;
+		T total;
+
 		bool leaf;
+
+		// the vertices' coordinates added up, for their centroid,
+		// which doesn't need the coordinates' extended precision
+		double sumX, sumY;
+
+		// used by stem nodes
 		QTNode* child[4];
 		
-		// used by leaf nodes
-		vector <pair <vertex, T> > bucket;
+		// used by leaf nodes, NULL until the leaf holds a vertex
+		QTBucket <T>* bucket;
+
+		// NULL unless a vertex below has a timestamp, so trees that
+		// never use them only pay for the pointer
+		QTTimes* times;
 		
 };
\ No newline at end of file
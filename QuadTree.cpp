@@ -5,25 +5,187 @@
 template <typename T>
 QuadTree<T>::QuadTree (vertex center, vertex range, unsigned bucketSize, unsigned depth)
 {
-	root = new QTNode <T>(center, range);
+	identity = T();
+	root = new QTNode <T>(center, range, identity);
 	maxDepth = depth;
 	maxBucketSize = bucketSize;
+	encodingBits = 0;
+	maxError = 0;
+	horizon = -numeric_limits<double>::infinity();
+	modifications = 0;
+}
+
+template <typename T>
+QuadTree<T>::QuadTree (vertex center, vertex range, T identity, function <T (const T&, const T&)> combine, unsigned bucketSize, unsigned depth)
+{
+	this->identity = identity;
+	this->combine = combine;
+	root = new QTNode <T>(center, range, identity);
+	maxDepth = depth;
+	maxBucketSize = bucketSize;
+	encodingBits = 0;
+	maxError = 0;
+	horizon = -numeric_limits<double>::infinity();
+	modifications = 0;
+}
+
+template <typename T>
+QuadTree<T>::QuadTree (const QuadTree<T>& tree)
+{
+	root = tree.root;
+	root->refs++;
+	maxDepth = tree.maxDepth;
+	maxBucketSize = tree.maxBucketSize;
+	encodingBits = tree.encodingBits;
+	maxError = tree.maxError;
+	horizon = tree.horizon;
+	modifications = tree.modifications;
+	identity = tree.identity;
+	combine = tree.combine;
 }
 
 template <typename T>
 QuadTree<T>::~QuadTree ()
 {
-	delete root;
+	QTNode<T>::release (root);
+}
+
+template <typename T>
+QuadTree<T>& QuadTree<T>::operator = (const QuadTree<T>& tree)
+{
+	// take the new reference first in case both trees share a root
+	tree.root->refs++;
+	QTNode<T>::release (root);
+	root = tree.root;
+	maxDepth = tree.maxDepth;
+	maxBucketSize = tree.maxBucketSize;
+	encodingBits = tree.encodingBits;
+	maxError = tree.maxError;
+	horizon = tree.horizon;
+	modifications++;
+	identity = tree.identity;
+	combine = tree.combine;
+	return *this;
+}
+
+template <typename T>
+const QuadTree<T> QuadTree<T>::snapshot () const
+{
+	// the snapshot shares every node, later writes to the live tree
+	// copy the nodes they touch instead of changing them in place,
+	// and the snapshot itself is read only
+	return QuadTree<T>(*this);
+}
+
+template <typename T>
+bool QuadTree<T>::setEncoding (unsigned bits, long double maxError)
+{
+	// entries already stored were encoded with the old width,
+	// so the encoding can only be picked while the tree is empty
+	if (root->count > 0 || (bits != 0 && bits != 16 && bits != 32)){
+		return false;
+	}
+	encodingBits = bits;
+	this->maxError = maxError;
+	return true;
 }
 
 template <typename T>
 void QuadTree<T>::insert (vertex v, T data)
 {
-	insert (v, data, root, 0);
+	modifications++;
+	insert (v, data, numeric_limits<double>::infinity(), own (root), 0, NULL);
+}
+
+template <typename T>
+void QuadTree<T>::insert (vertex v, T data, double time)
+{
+	modifications++;
+	insert (v, data, time, own (root), 0, NULL);
 }
 
 template <typename T>
-int QuadTree<T>::direction (const vertex& point, QTNode<T>* node)
+unsigned QuadTree<T>::expireOlderThan (double time, bool lazy)
+{
+	// a lazy expiry only hides the old vertices from queries
+	if (horizon < time){
+		horizon = time;
+		modifications++;
+	}
+	if (lazy){
+		return 0;
+	}
+	unsigned removed = expire (root, time);
+	modifications += (removed > 0);
+	return removed;
+}
+
+template <typename T>
+unsigned QuadTree<T>::compact ()
+{
+	unsigned removed = expire (root, horizon);
+	modifications += (removed > 0);
+	return removed;
+}
+
+template <typename T>
+unsigned QuadTree<T>::expire (QTNode<T>*& node, double time)
+{
+	// nothing below this node is old enough, leave it (and any
+	// snapshot sharing it) alone
+	if (node->minTime() >= time){
+		return 0;
+	}
+	own (node);
+
+	unsigned removed = 0;
+	if (node->leaf){
+		for (int i=bucketSize (node)-1; i >= 0; --i){
+			if (bucketTime (node, i) < time){
+				bucketErase (node, i);
+				removed++;
+			}
+		}
+	}
+	else{
+		for (int i=0; i < 4; ++i){
+			if (!node->child[i]){
+				continue;
+			}
+			// everything below this child is old, drop it without a look
+			if (node->child[i]->maxTime() < time){
+				removed += node->child[i]->count;
+				QTNode<T>::release (node->child[i]);
+				node->child[i] = NULL;
+			}
+			else{
+				removed += expire (node->child[i], time);
+			}
+		}
+	}
+	refresh (node);
+	if (!node->leaf){
+		collapse (node);
+	}
+	return removed;
+}
+
+template <typename T>
+QTNode<T>* QuadTree<T>::own (QTNode<T>*& node)
+{
+	// make sure this tree is the only owner of a node before it is
+	// written to, the parent must already be owned since its child
+	// pointer is replaced with the copy
+	if (node->refs > 1){
+		QTNode<T>* copy = new QTNode<T>(*node);
+		QTNode<T>::release (node);
+		node = copy;
+	}
+	return node;
+}
+
+template <typename T>
+int QuadTree<T>::direction (const vertex& point, QTNode<T>* node) const
 {
 	// get the quadrant that would contain the vertex
 	// in reference to a given start node
@@ -34,24 +196,32 @@ int QuadTree<T>::direction (const vertex& point, QTNode<T>* node)
 }
 
 template <typename T>
-QTNode<T>* QuadTree<T>::childNode (const vertex& v, QTNode<T>* node)
+int QuadTree<T>::direction (const grid_code& code) const
 {
-	// get the next node that would contain the vertex
-	// in reference to a given start node
-	unsigned dir = direction (v, node);
+	// a quantized entry's quadrant is given by the top bit of its
+	// offsets, its decoded position could round onto the other side
+	unsigned long long half = 1ULL << (encodingBits-1);
+	return ((code.x >= half)<<1) | ((code.y >= half)<<0);
+}
+
+template <typename T>
+QTNode<T>* QuadTree<T>::childNode (int dir, QTNode<T>* node)
+{
+	// get the next node in the given quadrant
+	// of a given start node
 	if (node->child[dir]){
-		return node->child[dir];
+		return own (node->child[dir]);
 	}
 	// node not found, so create it 
 	else{
 		vertex r(node->range.x/2.0, node->range.y/2.0);
-		node->child[dir] = new QTNode<T>(newCenter (dir, node), r);
+		node->child[dir] = new QTNode<T>(newCenter (dir, node), r, identity);
 		return node->child[dir];
 	}
 }
 
 template <typename T>
-vertex QuadTree<T>::newCenter (int direction, QTNode<T>* node)
+vertex QuadTree<T>::newCenter (int direction, QTNode<T>* node) const
 {
 	vertex v(node->center.x, node->center.y); 
 	switch (direction){
@@ -76,112 +246,489 @@ vertex QuadTree<T>::newCenter (int direction, QTNode<T>* node)
 }
 
 template <typename T>
-void QuadTree<T>::insert (vertex v, T data, QTNode<T>* node, unsigned depth)
+vertex QuadTree<T>::insert (vertex v, T data, double time, QTNode<T>* node, unsigned depth, const grid_code* code)
 {
+	// every node on the way down to the leaf gains the vertex, its
+	// coordinates are added on the way back up as they were stored
+	setTimes (node, min (node->minTime(), time), max (node->maxTime(), time));
+	node->count++;
+	if (combine){
+		node->total = combine (node->total, data);
+	}
+	vertex delta;
+
 	// by design, vertices are stored only in leaf nodes
 	// newly created nodes are leaf nodes by default
 	if (node->leaf){
-		// there is room in this node's bucket
-		if (node->bucket.size() < maxBucketSize){
-			node->bucket.push_back ({v, data});
+		// there is room in this node's bucket, or the node is
+		// as deep as it can go and its bucket has to overflow
+		if (bucketSize (node) < maxBucketSize || depth >= maxDepth){
+			delta = bucketPush (node, v, data, time, code);
 		}
 		// bucket is full, so push all vertices to next depth,
 		// clear the current node's bucket and make it a stem
-		else if (depth < maxDepth){
+		else{
+			// (the quantized entries first and the new vertex last, so
+			// that a vertex quantized in a child can't take the grid
+			// cell of an entry that hasn't moved down yet)
+			double beforeX = node->sumX, beforeY = node->sumY;
 			node->leaf = false;
-			insert (v, data, childNode (v, node), depth+1);
-			for (int i=0; i < node->bucket.size(); ++i){
-				insert (node->bucket[i].first, data, childNode(node->bucket[i].first, node), depth+1);
+			for (int i=exactSize (node); i < bucketSize (node); ++i){
+				grid_code c = unpack (node, i - exactSize (node));
+				descend (bucketPoint (node, i), bucketData (node, i), bucketTime (node, i), node, depth, &c);
+			}
+			for (int i=0; i < exactSize (node); ++i){
+				descend (bucketPoint (node, i), bucketData (node, i), bucketTime (node, i), node, depth, NULL);
 			}
-			node->bucket.clear();
+			bucketClear (node);
+			descend (v, data, time, node, depth, code);
+			// the moved entries are decoded on the children's grids now
+			refresh (node);
+			return vertex (node->sumX - beforeX, node->sumY - beforeY);
 		}
 	}
 	// current node is a stem node used for navigation
 	else{
-		insert (v, data, childNode (v, node), depth+1);
+		delta = descend (v, data, time, node, depth, code);
+	}
+	node->sumX += delta.x;
+	node->sumY += delta.y;
+	return delta;
+}
+
+template <typename T>
+vertex QuadTree<T>::descend (vertex v, T data, double time, QTNode<T>* node, unsigned depth, const grid_code* code)
+{
+	// a quantized entry moves to the child's grid by an exact shift of
+	// its offsets, so it keeps its position on every level
+	if (code){
+		grid_code c = narrow (*code);
+		return insert (v, data, time, childNode (direction (*code), node), depth+1, &c);
+	}
+	else{
+		return insert (v, data, time, childNode (direction (v, node), node), depth+1, NULL);
 	}
 }
 
 template <typename T>
 bool QuadTree<T>::remove (vertex v)
 {
+	// look before writing, so that a failed remove doesn't
+	// copy nodes that are shared with a snapshot
+	if (!contains (v)){
+		return false;
+	}
+
 	stack <QTNode<T>*> nodes;
-	nodes.push (root);
+	nodes.push (own (root));
 	QTNode<T>* top = nodes.top();
-	unsigned dir;
 
 	// navigate to leaf node containing the vertex to be deleted
 	while (!top->leaf){
-		dir = direction (v, top);
-		if (top->child[dir]){
-			nodes.push (top->child[dir]);
-			top = nodes.top();
-		}
-		else{
-			return false;
-		}
+		nodes.push (own (top->child[direction (v, top)]));
+		top = nodes.top();
 	}	
 	// linearly search bucket for target vertex
-	for (int i=0; i < top->bucket.size(); ++i){
-		// vertex found, delete from bucket
-		if (top->bucket[i].first == v){
-			top->bucket.erase(top->bucket.begin()+i);
-			reduce (nodes);
-			return true;
-		}
-		else{
-			return false;
-		}
-	}	
+	int i = bucketFind (top, v);
+	if (i < 0){
+		return false;
+	}
+	bucketErase (top, i);
+	reduce (nodes);
+	modifications++;
+	return true;
 }
 
 template <typename T>
 void QuadTree<T>::reduce (stack <QTNode<T>*>& nodes)
 {
 	// once a vertex is removed from a leaf node's bucket
-	// check to see if that node's parent can consume it
+	// recount the path from the leaf back up to the root,
+	// and check to see if that node's parent can consume it
 	// and all of it's sibling nodes
-	bool canReduce = true;
+	refresh (nodes.top());
 	nodes.pop();
-	while (canReduce && !nodes.empty()) {
-		canReduce = true;
-		QTNode<T>* top = nodes.top();
-		int numKeys = 0;
-		for (int i=0; i < 4; ++i){
-			if (top->child[i] && !top->child[i]->leaf){
+	bool merging = true;
+	while (!nodes.empty()){
+		refresh (nodes.top());
+		merging = merging && collapse (nodes.top());
+		nodes.pop();
+	}
+}
+
+template <typename T>
+bool QuadTree<T>::collapse (QTNode<T>* top)
+{
+	// merge a stem's children back into it when they are all
+	// leaves and their vertices fit in one bucket
+	bool canReduce = true;
+	int numKeys = 0;
+	for (int i=0; i < 4; ++i){
+		if (top->child[i] && !top->child[i]->leaf){
+			return false;
+		}
+		else if (top->child[i] && top->child[i]->leaf){
+			numKeys += bucketSize (top->child[i]);
+		}
+	}
+	canReduce &= (numKeys <= maxBucketSize);
+	// a quantized vertex that falls between the parent's grid lines
+	// would lose precision in the merge, and the parent's grid cells
+	// have to be as wide as the widest the children had, so the
+	// children are kept if two entries would share one
+	vector <grid_code> codes;
+	int level = numeric_limits<int>::min();
+	for (int i=0; canReduce && i < 4; ++i){
+		for (int j=0; top->child[i] && j < bucketSize (top->child[i]) - exactSize (top->child[i]); ++j){
+			grid_code c;
+			if (!widen (unpack (top->child[i], j), i, c)){
 				canReduce = false;
-				return;
+				break;
 			}
-			else if (top->child[i] && top->child[i]->leaf){
-				numKeys += top->child[i]->bucket.size();
+			level = max (level, c.level);
+			codes.push_back (c);
+		}
+	}
+	for (int k=0; canReduce && k < codes.size(); ++k){
+		codes[k].level = level;
+	}
+	canReduce = canReduce && (codes.empty() || (level >= -FINE_BITS && distinct (codes, level)));
+	if (canReduce){
+		// the quantized entries go first, so that an exact one quantized
+		// in the parent can't take the grid cell one of them stands for
+		for (int i=0, k=0; i < 4; ++i){
+			for (int j=0; top->child[i] && j < bucketSize (top->child[i]) - exactSize (top->child[i]); ++j){
+				unsigned e = exactSize (top->child[i]) + j;
+				bucketPush (top, bucketPoint (top->child[i], e), bucketData (top->child[i], e), bucketTime (top->child[i], e), &codes[k++]);
 			}
 		}
-		canReduce &= (numKeys <= maxBucketSize);
-		if (canReduce){
-			for (int i=0; i < 4; ++i){
-				if (top->child[i]){
-					for (int j=0; j < top->child[i]->bucket.size(); ++j){
-						top->bucket.push_back ( top->child[i]->bucket[j] );
-					}
-					delete top->child[i];
-					top->child[i] = NULL;
+		for (int i=0; i < 4; ++i){
+			if (top->child[i]){
+				for (int j=0; j < exactSize (top->child[i]); ++j){
+					bucketPush (top, bucketPoint (top->child[i], j), bucketData (top->child[i], j), bucketTime (top->child[i], j), NULL);
 				}
+				QTNode<T>::release (top->child[i]);
+				top->child[i] = NULL;
 			}
-			top->leaf = true;
 		}
-		nodes.pop();
+		top->leaf = true;
+		// the merged entries are decoded on the parent's grid now
+		refresh (top);
 	}
-	return;
+	return canReduce;
 }	
 
 template <typename T>
-bool QuadTree<T>::contains (vertex v)
+void QuadTree<T>::refresh (QTNode<T>* node)
+{
+	// rebuild a node's count and total from its bucket or its children
+	node->count = 0;
+	node->total = identity;
+	node->sumX = 0;
+	node->sumY = 0;
+	double minTime = numeric_limits<double>::infinity();
+	double maxTime = -numeric_limits<double>::infinity();
+	if (node->leaf){
+		node->count = bucketSize (node);
+		for (int i=0; i < bucketSize (node); ++i){
+			if (combine){
+				node->total = combine (node->total, bucketData (node, i));
+			}
+			minTime = min (minTime, bucketTime (node, i));
+			maxTime = max (maxTime, bucketTime (node, i));
+			node->sumX += bucketPoint (node, i).x;
+			node->sumY += bucketPoint (node, i).y;
+		}
+	}
+	else{
+		for (int i=0; i < 4; ++i){
+			if (node->child[i]){
+				node->count += node->child[i]->count;
+				if (combine){
+					node->total = combine (node->total, node->child[i]->total);
+				}
+				minTime = min (minTime, node->child[i]->minTime());
+				maxTime = max (maxTime, node->child[i]->maxTime());
+				node->sumX += node->child[i]->sumX;
+				node->sumY += node->child[i]->sumY;
+			}
+		}
+	}
+	setTimes (node, minTime, maxTime);
+}
+
+template <typename T>
+void QuadTree<T>::setTimes (QTNode<T>* node, double minTime, double maxTime)
+{
+	// with nothing below carrying a timestamp the node's defaults
+	// already give these, and it can drop its timestamps
+	if (minTime == numeric_limits<double>::infinity()){
+		delete node->times;
+		node->times = NULL;
+		return;
+	}
+	if (!node->times){
+		node->times = new QTTimes;
+	}
+	node->times->minTime = minTime;
+	node->times->maxTime = maxTime;
+}
+
+template <typename T>
+bool QuadTree<T>::contains (vertex v) const
+{
+	QTNode<T>* node = root;
+
+	// navigate to leaf node that would contain the vertex
+	while (!node->leaf){
+		node = node->child[direction (v, node)];
+		if (!node){
+			return false;
+		}
+	}
+	int i = bucketFind (node, v);
+	return (i >= 0) && (bucketTime (node, i) >= horizon);
+}
+
+template <typename T>
+unsigned QuadTree<T>::bucketSize (QTNode<T>* node) const
 {
-	return false;
+	return node->bucket ? node->bucket->exact + node->bucket->packed : 0;
 }
 
 template <typename T>
-string QuadTree<T>::print ()
+unsigned QuadTree<T>::exactSize (QTNode<T>* node) const
+{
+	return node->bucket ? node->bucket->exact : 0;
+}
+
+template <typename T>
+vertex QuadTree<T>::bucketPoint (QTNode<T>* node, unsigned i) const
+{
+	// exact entries are numbered first, then the quantized ones
+	if (i < exactSize (node)){
+		return node->bucket->points()[i];
+	}
+	return decode (node, unpack (node, i - exactSize (node)));
+}
+
+template <typename T>
+const T& QuadTree<T>::bucketData (QTNode<T>* node, unsigned i) const
+{
+	return node->bucket->data()[i];
+}
+
+template <typename T>
+double QuadTree<T>::bucketTime (QTNode<T>* node, unsigned i) const
+{
+	// leaves that never held an expiring vertex keep no timestamps
+	return node->bucket->timed ? node->bucket->times()[i] : numeric_limits<double>::infinity();
+}
+
+template <typename T>
+int QuadTree<T>::bucketFind (QTNode<T>* node, const vertex& v) const
+{
+	for (int i=0; i < exactSize (node); ++i){
+		if (node->bucket->points()[i] == v){
+			return i;
+		}
+	}
+	// a quantized entry stands for every vertex in its grid cell that
+	// is within the allowed error of it, and no two entries of a leaf
+	// stand for the same grid cell
+	grid_code c;
+	if (exactSize (node) == bucketSize (node) || !encode (node, v, c, FINE_BITS)){
+		return -1;
+	}
+	int i = packedFind (node, c, node->bucket->level);
+	if (i < 0){
+		return -1;
+	}
+	vertex q = decode (node, unpack (node, i));
+	if (fabsl (v.x - q.x) <= maxError && fabsl (v.y - q.y) <= maxError){
+		return exactSize (node) + i;
+	}
+	return -1;
+}
+
+template <typename T>
+vertex QuadTree<T>::bucketPush (QTNode<T>* node, const vertex& v, const T& data, double time, const grid_code* code)
+{
+	QTBucket<T>* b = node->bucket;
+
+	// an entry moved from another cell keeps its code, a new vertex is
+	// quantized if it rounds to within the allowed error and into a grid
+	// cell that no quantized entry of this leaf stands for yet. It is
+	// rounded onto this leaf's grid, so the leaf's grid cells can't be
+	// any finer than that
+	grid_code c;
+	vector <grid_code> codes;
+	bool quantized = (code != NULL);
+	if (code){
+		c = *code;
+	}
+	else if (encodingBits > 0 && encode (node, v, c)){
+		c.level = (b && b->packed > 0) ? max ((int)b->level, 0) : 0;
+		vertex q = decode (node, c);
+		quantized = (fabsl (v.x - q.x) <= maxError) && (fabsl (v.y - q.y) <= maxError);
+		if (quantized && b && b->packed > 0){
+			grid_code f = {c.x << FINE_BITS, c.y << FINE_BITS, c.level};
+			quantized = packedFind (node, f, c.level) < 0;
+			for (int i=0; quantized && c.level != b->level && i < b->packed; ++i){
+				codes.push_back (unpack (node, i));
+			}
+			quantized = quantized && distinct (codes, c.level);
+		}
+	}
+
+	// start keeping timestamps once the first expiring vertex arrives,
+	// the entries already there never expire
+	unsigned exact = exactSize (node) + !quantized;
+	unsigned packed = bucketSize (node) - exactSize (node) + quantized;
+	bool timed = (b && b->timed) || time != numeric_limits<double>::infinity();
+	node->bucket = QTBucket<T>::resize (b, exact, packed, encodingBits/8, timed);
+	QTBucket<T>::destroy (b);
+	b = node->bucket;
+
+	unsigned i = quantized ? exact + packed - 1 : exact - 1;
+	new (&b->data()[i]) T (data);
+	if (timed){
+		b->times()[i] = time;
+	}
+	if (quantized){
+		int words = encodingBits/16;
+		unsigned short* w = &b->codes()[(packed-1)*2*words];
+		for (int k=0; k < words; ++k){
+			w[k] = (c.x >> (16*(words-1-k))) & 0xffff;
+			w[words+k] = (c.y >> (16*(words-1-k))) & 0xffff;
+		}
+		b->level = c.level;
+		return decode (node, c);
+	}
+	b->points()[i] = v;
+	return v;
+}
+
+template <typename T>
+void QuadTree<T>::bucketErase (QTNode<T>* node, unsigned i)
+{
+	QTBucket<T>* b = node->bucket;
+	if (bucketSize (node) == 1){
+		bucketClear (node);
+		return;
+	}
+	node->bucket = QTBucket<T>::resize (b, b->exact - (i < b->exact), b->packed - (i >= b->exact), b->words, b->timed, i);
+	QTBucket<T>::destroy (b);
+}
+
+template <typename T>
+void QuadTree<T>::bucketClear (QTNode<T>* node)
+{
+	// stems and empty leaves don't hold on to the storage
+	QTBucket<T>::destroy (node->bucket);
+	node->bucket = NULL;
+}
+
+template <typename T>
+int QuadTree<T>::packedFind (QTNode<T>* node, const grid_code& code, int level) const
+{
+	// the quantized entry whose grid cell, 2^level steps wide, holds the
+	// given offset, which is FINE_BITS finer than the leaf's grid
+	int shift = level + FINE_BITS;
+	for (int i=0; i < bucketSize (node) - exactSize (node); ++i){
+		grid_code p = unpack (node, i);
+		if ((code.x >> shift) == ((p.x << FINE_BITS) >> shift) && (code.y >> shift) == ((p.y << FINE_BITS) >> shift)){
+			return i;
+		}
+	}
+	return -1;
+}
+
+template <typename T>
+bool QuadTree<T>::distinct (const vector <grid_code>& codes, int level) const
+{
+	// whether no two entries share a grid cell 2^level steps wide
+	int shift = level + FINE_BITS;
+	for (int i=0; i < codes.size(); ++i){
+		for (int j=0; j < i; ++j){
+			if (((codes[i].x << FINE_BITS) >> shift) == ((codes[j].x << FINE_BITS) >> shift) &&
+				((codes[i].y << FINE_BITS) >> shift) == ((codes[j].y << FINE_BITS) >> shift)){
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+template <typename T>
+bool QuadTree<T>::encode (QTNode<T>* node, const vertex& v, grid_code& code, unsigned finer) const
+{
+	// round down to the grid, so a quantized vertex stays on the same
+	// side of every child boundary as the vertex it came from
+	long double steps = ldexpl (1.0, encodingBits + finer);
+	long double fx = floorl ((v.x - (node->center.x - node->range.x)) * steps / (2*node->range.x));
+	long double fy = floorl ((v.y - (node->center.y - node->range.y)) * steps / (2*node->range.y));
+	if (!(fx >= 0 && fx < steps && fy >= 0 && fy < steps)){
+		return false;
+	}
+	code.x = fx;
+	code.y = fy;
+	code.level = 0;
+	return true;
+}
+
+template <typename T>
+vertex QuadTree<T>::decode (QTNode<T>* node, const grid_code& code) const
+{
+	return vertex (node->center.x - node->range.x + ldexpl (code.x * 2*node->range.x, -(int)encodingBits),
+				   node->center.y - node->range.y + ldexpl (code.y * 2*node->range.y, -(int)encodingBits));
+}
+
+template <typename T>
+grid_code QuadTree<T>::unpack (QTNode<T>* node, unsigned i) const
+{
+	unsigned words = encodingBits/16;
+	const unsigned short* w = &node->bucket->codes()[2*words*i];
+	grid_code code = {0, 0, node->bucket->level};
+	for (int k=0; k < words; ++k){
+		code.x = (code.x << 16) | w[k];
+		code.y = (code.y << 16) | w[words+k];
+	}
+	return code;
+}
+
+template <typename T>
+grid_code QuadTree<T>::narrow (const grid_code& code) const
+{
+	// a child's grid is twice as fine and starts either at the parent's
+	// lower left corner or halfway along, so the entry's offset doubles
+	// and its grid cell gets twice as many steps wide (up to the whole
+	// cell, a vertex further away is found by its stored position)
+	unsigned long long steps = 1ULL << encodingBits;
+	grid_code c;
+	c.x = 2*code.x - ((code.x >= steps/2) ? steps : 0);
+	c.y = 2*code.y - ((code.y >= steps/2) ? steps : 0);
+	c.level = min (code.level+1, (int)encodingBits);
+	return c;
+}
+
+template <typename T>
+bool QuadTree<T>::widen (const grid_code& code, int dir, grid_code& parent) const
+{
+	// the reverse of narrow for an entry of the child in quadrant dir,
+	// one on an odd step has no place on the parent's grid
+	if ((code.x | code.y) & 1){
+		return false;
+	}
+	unsigned long long steps = 1ULL << encodingBits;
+	parent.x = (code.x + ((dir & 2) ? steps : 0)) / 2;
+	parent.y = (code.y + ((dir & 1) ? steps : 0)) / 2;
+	parent.level = code.level-1;
+	return true;
+}
+
+template <typename T>
+string QuadTree<T>::print () const
 {
 	stringstream ss("");
 	print (root, ss);
@@ -189,14 +736,14 @@ string QuadTree<T>::print ()
 }
 
 template <typename T>
-void QuadTree<T>::print (QTNode<T>* node, stringstream& ss)
+void QuadTree<T>::print (QTNode<T>* node, stringstream& ss) const
 {
 	for (int i=0; i < 4; ++i){
 		if (node->child[i]){
 			print (node->child[i], ss);
-			for (int i = 0; i < node->bucket.size(); i++){
-				ss << '{' << node->bucket[i].first.x << ','
-						 << node->bucket[i].first.y << '}' << ' ';
+			for (int i = 0; i < bucketSize (node); i++){
+				ss << '{' << bucketPoint (node, i).x << ','
+						 << bucketPoint (node, i).y << '}' << ' ';
 			}
 		}
 	}	
@@ -204,7 +751,7 @@ void QuadTree<T>::print (QTNode<T>* node, stringstream& ss)
 }
 
 template <typename T>
-vector <pair <vertex, T> > QuadTree<T>::getObjectsInRegion (vertex minXY, vertex maxXY)
+vector <pair <vertex, T> > QuadTree<T>::getObjectsInRegion (vertex minXY, vertex maxXY) const
 {
 	vector <pair <vertex, T> > results;
 	queue <QTNode<T>*> nodes;
@@ -218,16 +765,17 @@ vector <pair <vertex, T> > QuadTree<T>::getObjectsInRegion (vertex minXY, vertex
 				// this node is completely contained within the search region
 				case NODE_CONTAINED_BY_REGION:
 					// add all elements to results
-					results.insert (results.end(), top->bucket.begin(), top->bucket.end());
+					addAllPointsToResults (top, results);
 				break;
 
 				// this node is partially contained by the region
 				case  NODE_PARTIALLY_IN_REGION:
 					// search through this leaf node's bucket
-					for (int i=0; i < top->bucket.size(); ++i){
+					for (int i=0; i < bucketSize (top); ++i){
 						// check if this point is in the region
-						if (pointInRegion(top->bucket[i].first, minXY, maxXY)){
-							results.push_back (top->bucket[i]);
+						vertex p = bucketPoint (top, i);
+						if (pointInRegion(p, minXY, maxXY) && bucketTime (top, i) >= horizon){
+							results.push_back ({p, bucketData (top, i)});
 						}
 					}
 				break;
@@ -240,7 +788,8 @@ vector <pair <vertex, T> > QuadTree<T>::getObjectsInRegion (vertex minXY, vertex
 		}
 		else{
 			for (int i=0; i < 4; ++i){
-				if (top->child[i]){
+				// skip children whose vertices have all expired
+				if (top->child[i] && top->child[i]->maxTime() >= horizon){
 					// check if this nodes children could have points in the region
 					enclosure_status status = getEnclosureStatus (top->child[i]->center, top->child[i]->range, minXY, maxXY);
 					switch (status){
@@ -267,33 +816,165 @@ vector <pair <vertex, T> > QuadTree<T>::getObjectsInRegion (vertex minXY, vertex
 }
 
 template <typename T>
-void QuadTree<T>::addAllPointsToResults (QTNode<T>* node, vector <pair <vertex, T> >& results)
+unsigned QuadTree<T>::countInRegion (vertex minXY, vertex maxXY) const
 {
-	if (node->leaf){
-		results.insert (results.end(), node->bucket.begin(), node->bucket.end());
+	unsigned count = 0;
+	T total = identity;
+	aggregate (root, minXY, maxXY, count, total);
+	return count;
+}
+
+template <typename T>
+T QuadTree<T>::aggregateInRegion (vertex minXY, vertex maxXY) const
+{
+	unsigned count = 0;
+	T total = identity;
+	aggregate (root, minXY, maxXY, count, total);
+	return total;
+}
+
+template <typename T>
+void QuadTree<T>::aggregate (QTNode<T>* node, const vertex& minXY, const vertex& maxXY, unsigned& count, T& total) const
+{
+	// everything below has expired
+	if (node->maxTime() < horizon){
+		return;
+	}
+	enclosure_status status = getEnclosureStatus (node->center, node->range, minXY, maxXY);
+	// a contained subtree still holding expired vertices has to be
+	// searched like a partial one
+	if (status == NODE_CONTAINED_BY_REGION && node->minTime() < horizon){
+		status = NODE_PARTIALLY_IN_REGION;
+	}
+	switch (status){
+		// the whole subtree is in the region, use its totals without descending
+		case NODE_CONTAINED_BY_REGION:
+			count += node->count;
+			if (combine){
+				total = combine (total, node->total);
+			}
+		break;
+
+		// only part of this node is in the region, check points or children
+		case NODE_PARTIALLY_IN_REGION:
+			if (node->leaf){
+				for (int i=0; i < bucketSize (node); ++i){
+					if (pointInRegion (bucketPoint (node, i), minXY, maxXY) && bucketTime (node, i) >= horizon){
+						count++;
+						if (combine){
+							total = combine (total, bucketData (node, i));
+						}
+					}
+				}
+			}
+			else{
+				for (int i=0; i < 4; ++i){
+					if (node->child[i]){
+						aggregate (node->child[i], minXY, maxXY, count, total);
+					}
+				}
+			}
+		break;
+
+		// no points in region, discontinue searching this branch
+		case NODE_NOT_IN_REGION:
+		break;
+	}
+}
+
+template <typename T>
+vector <lod_cell> QuadTree<T>::queryLOD (vertex minXY, vertex maxXY, long double minCellSize) const
+{
+	vector <lod_cell> cells;
+	queryLOD (root, minXY, maxXY, minCellSize, cells);
+	return cells;
+}
+
+template <typename T>
+void QuadTree<T>::queryLOD (QTNode<T>* node, const vertex& minXY, const vertex& maxXY, long double minCellSize, vector <lod_cell>& cells) const
+{
+	// nothing to show below this node
+	if (node->count == 0 || node->maxTime() < horizon){
+		return;
+	}
+	enclosure_status status = getEnclosureStatus (node->center, node->range, minXY, maxXY);
+	if (status == NODE_NOT_IN_REGION){
+		return;
+	}
+
+	// a stem at the requested resolution stands in for everything below it,
+	// as does a leaf whose vertices are all in the region and visible
+	bool small = 2*max (node->range.x, node->range.y) <= minCellSize;
+	if (node->leaf ? (status == NODE_CONTAINED_BY_REGION && node->minTime() >= horizon) : small){
+		cells.push_back ({node->center, node->range, node->count,
+						  vertex (node->sumX/node->count, node->sumY/node->count)});
+	}
+	// otherwise a leaf only counts the vertices that are in the region
+	else if (node->leaf){
+		lod_cell cell = {node->center, node->range, 0, vertex (0, 0)};
+		for (int i=0; i < bucketSize (node); ++i){
+			vertex p = bucketPoint (node, i);
+			if (pointInRegion (p, minXY, maxXY) && bucketTime (node, i) >= horizon){
+				cell.count++;
+				cell.centroid.x += p.x;
+				cell.centroid.y += p.y;
+			}
+		}
+		if (cell.count > 0){
+			cell.centroid.x /= cell.count;
+			cell.centroid.y /= cell.count;
+			cells.push_back (cell);
+		}
 	}
 	else{
 		for (int i=0; i < 4; ++i){
 			if (node->child[i]){
-				addAllPointsToResults (node->child[i], results);
+				queryLOD (node->child[i], minXY, maxXY, minCellSize, cells);
 			}
 		}
 	}
 }
 
 template <typename T>
-bool QuadTree<T>::pointInRegion (const vertex& point, const vertex& minXY, const vertex& maxXY)
+unsigned long QuadTree<T>::version () const
+{
+	// changes whenever the tree's contents (or the vertices visible
+	// to queries) may have changed, for callers that cache results
+	return modifications;
+}
+
+template <typename T>
+void QuadTree<T>::addAllPointsToResults (QTNode<T>* node, vector <pair <vertex, T> >& results) const
 {
-	if ( (point.x >= minXY.x) && (point.x < maxXY.x) && (point.y >= minXY.y) && (point.y < maxXY.y) ) {
-		return true;
+	if (node->leaf && node->minTime() >= horizon){
+		if (node->bucket){
+			for (int i=0; i < exactSize (node); ++i){
+				results.push_back ({node->bucket->points()[i], node->bucket->data()[i]});
+			}
+		}
+		for (int i=exactSize (node); i < bucketSize (node); ++i){
+			results.push_back ({bucketPoint (node, i), bucketData (node, i)});
+		}
+	}
+	// some of this leaf's vertices have expired
+	else if (node->leaf){
+		for (int i=0; i < bucketSize (node); ++i){
+			if (bucketTime (node, i) >= horizon){
+				results.push_back ({bucketPoint (node, i), bucketData (node, i)});
+			}
+		}
 	}
 	else{
-		return false;
+		for (int i=0; i < 4; ++i){
+			if (node->child[i] && node->child[i]->maxTime() >= horizon){
+				addAllPointsToResults (node->child[i], results);
+			}
+		}
 	}
 }
 
 template <typename T>
-enclosure_status QuadTree<T>::getEnclosureStatus (const vertex& center, const vertex& range, const vertex& minXY, const vertex& maxXY)
+enclosure_status QuadTree<T>::getEnclosureStatus (const vertex& center, const vertex& range, const vertex& minXY, const vertex& maxXY) const
 {
 	int enclosedPts = 0;
 	enclosedPts += pointInRegion ({center.x-range.x, center.y-range.y}, minXY, maxXY);
@@ -304,25 +985,17 @@ enclosure_status QuadTree<T>::getEnclosureStatus (const vertex& center, const ve
 	if (enclosedPts == 4){
 		return NODE_CONTAINED_BY_REGION;
 	}
-	else if (enclosedPts > 0){
+	// no corner of either box needs to fall inside the other for them to
+	// overlap (e.g. a thin strip crossing the node), so compare the extents
+	else if ( (center.x-range.x <= maxXY.x) && (center.x+range.x >= minXY.x) &&
+			  (center.y-range.y <= maxXY.y) && (center.y+range.y >= minXY.y) ){
 		return NODE_PARTIALLY_IN_REGION;
 	}
-	else {
-		vertex nodeMin (center.x-range.x, center.y-range.y);
-		vertex nodeMax (center.x+range.x, center.y+range.y);
-		enclosedPts += pointInRegion (minXY, nodeMin, nodeMax);
-		enclosedPts += pointInRegion ({minXY.x, maxXY.y}, nodeMin, nodeMax);
-		enclosedPts += pointInRegion (maxXY, nodeMin, nodeMax);
-		enclosedPts += pointInRegion ({maxXY.x, minXY.y}, nodeMin, nodeMax);
-		if (enclosedPts > 0){
-			return NODE_PARTIALLY_IN_REGION;
-		}
-	}
-		return NODE_NOT_IN_REGION;	
+	return NODE_NOT_IN_REGION;	
 }
 
 template <typename T>
-void QuadTree<T>::draw ()
+void QuadTree<T>::draw () const
 {
 	if (root){
 		draw (root);
@@ -330,7 +1003,7 @@ void QuadTree<T>::draw ()
 }
 
 template <typename T>
-void QuadTree<T>::draw (QTNode<T>* node)
+void QuadTree<T>::draw (QTNode<T>* node) const
 {
 	/*
 	glBegin (GL_LINE_LOOP);
@@ -354,9 +1027,9 @@ void QuadTree<T>::draw (QTNode<T>* node)
 		glVertex2f (node->center.x, node->center.y);
 		glVertex2f (node->center.x - node->range.x, node->center.y + node->range.y);
 
-		for (int i=0; i < node->bucket.size(); ++i){
+		for (int i=0; i < bucketSize (node); ++i){
 			glVertex2f (node->center.x, node->center.y);
-			glVertex2f (node->bucket[i].first.x, node->bucket[i].first.y);
+			glVertex2f (bucketPoint (node, i).x, bucketPoint (node, i).y);
 		}
 
 	glEnd();
@@ -5,12 +5,53 @@
 
 	Quadtree: a dynamic 2d space partitioning structure
 
+	Copies of a tree share their nodes. A node is only copied when one of
+	the trees sharing it is written through it (path copying), so
+	snapshot () is O(1) and a snapshot costs memory proportional to the
+	changes made after it was taken. The snapshot is const, so it can be
+	queried but not written to. Shared nodes are reference counted and
+	freed by whichever tree drops the last reference.
+
+	Every node keeps the number of vertices below it and, when the tree
+	is given a combine function, their data folded together (a sum, min,
+	max or any other commutative monoid with the given identity). Region
+	counts and aggregates then only visit the nodes on the region's
+	boundary.
+
+	Leaf buckets can store vertices quantized to 16 or 32 bit offsets
+	from the leaf's corner (see setEncoding). A vertex is kept exactly
+	instead if quantizing it would move it by more than the allowed
+	error or into a grid cell another quantized vertex of the leaf
+	stands for. remove and contains match a quantized vertex by its grid
+	cell, so any vertex in that cell within the allowed error matches.
+	Only leaves holding vertices allocate storage, so quantizing pays
+	off with large buckets.
+
+	Vertices can be inserted with a timestamp, and a node with one below
+	it keeps the oldest and newest timestamp there (other nodes only
+	hold a null pointer for them). expireOlderThan drops whole subtrees
+	that are older than the cutoff and skips subtrees that are newer, so
+	only the nodes straddling it are visited. A lazy expiry just hides
+	older vertices from queries until compact () removes them. Vertices
+	inserted without a timestamp never expire.
+
+	queryLOD summarizes a region at a given resolution: it stops at
+	nodes no larger than the requested cell size and reports each one
+	as a single cell (bounds, vertex count and centroid), so the output
+	grows with the region's area in cells rather than with the number
+	of vertices. A cell that stopped at the resolution limit reports its
+	whole node, which may include vertices just outside the region or
+	hidden by a lazy expiry.
+
 **/
 
 #ifndef QUADTREE_H
 #define QUADTREE_H
 
 #include <cstdlib>
+#include <cmath>
+#include <functional>
+#include <limits>
 #include <queue>
 #include <sstream>
 #include <stack>
@@ -40,36 +81,106 @@ enum enclosure_status
 	 NODE_CONTAINED_BY_REGION
 };
 
+// regions are half open, a point on the max edge is outside
+inline bool pointInRegion (const vertex& point, const vertex& minXY, const vertex& maxXY)
+{
+	return (point.x >= minXY.x) && (point.x < maxXY.x) && (point.y >= minXY.y) && (point.y < maxXY.y);
+}
+
+// one node's summary in a level of detail query
+struct lod_cell
+{
+	vertex center, range;
+	unsigned count;
+	vertex centroid;
+};
+
+// a quantized entry's offset on one cell's grid, and the width of the
+// grid cell it stands for as a power of two number of steps
+struct grid_code
+{
+	unsigned long long x, y;
+	int level;
+};
+
+// extra bits a vertex is rounded to when it is looked up, so that it
+// can be matched against grid cells finer than the leaf's grid, which
+// are left by merges
+#define FINE_BITS 16
+
 template <typename T>
 class QuadTree
 {
 	public:
 
 		QuadTree <T>(vertex center, vertex range, unsigned bucketSize=1, unsigned depth = 16);
+		QuadTree <T>(vertex center, vertex range, T identity, function <T (const T&, const T&)> combine, unsigned bucketSize=1, unsigned depth = 16);
+		QuadTree <T>(const QuadTree <T>& tree);
 		~QuadTree ();
 
+		QuadTree <T>& operator = (const QuadTree <T>& tree);
+		const QuadTree <T> snapshot () const;
+		bool	setEncoding (unsigned bits, long double maxError = numeric_limits<long double>::infinity());
+
 		void 	insert (vertex v, T data);
-		bool 	contains (vertex v);
+		void 	insert (vertex v, T data, double time);
+		unsigned expireOlderThan (double time, bool lazy = false);
+		unsigned compact ();
+		bool 	contains (vertex v) const;
 		bool 	remove (vertex v);
-		void 	draw ();
-		string 	print ();
-		vector <pair <vertex, T> > getObjectsInRegion (vertex minXY, vertex maxXY);
+		void 	draw () const;
+		string 	print () const;
+		vector <pair <vertex, T> > getObjectsInRegion (vertex minXY, vertex maxXY) const;
+		unsigned countInRegion (vertex minXY, vertex maxXY) const;
+		T 		aggregateInRegion (vertex minXY, vertex maxXY) const;
+		vector <lod_cell> queryLOD (vertex minXY, vertex maxXY, long double minCellSize) const;
+		unsigned long version () const;
 
 	private:
 
-		QTNode<T>* childNode (const vertex& v, QTNode<T>* node);
-		vertex 	newCenter (int direction, QTNode <T>* node);
-		int 	direction (const vertex& point, QTNode <T>* node);
-		void 	insert (vertex v, T data, QTNode<T>* node, unsigned depth);
+		QTNode<T>* own (QTNode<T>*& node);
+		QTNode<T>* childNode (int dir, QTNode<T>* node);
+		vertex 	newCenter (int direction, QTNode <T>* node) const;
+		int 	direction (const vertex& point, QTNode <T>* node) const;
+		int 	direction (const grid_code& code) const;
+		vertex 	insert (vertex v, T data, double time, QTNode<T>* node, unsigned depth, const grid_code* code);
+		vertex 	descend (vertex v, T data, double time, QTNode<T>* node, unsigned depth, const grid_code* code);
+		unsigned expire (QTNode<T>*& node, double time);
 		void	reduce (stack <QTNode<T>*>& node);
-		void 	draw (QTNode<T>* node);
-		void 	print (QTNode <T>* node, stringstream& ss);
-		void	addAllPointsToResults (QTNode<T>* node, vector <pair <vertex, T> >& results);
-		bool	pointInRegion (const vertex& point, const vertex& minXY, const vertex& maxXY);
-		enclosure_status getEnclosureStatus (const vertex& center, const vertex& range, const vertex& minXY, const vertex& maxXY);
+		bool	collapse (QTNode<T>* node);
+		void	refresh (QTNode<T>* node);
+		void	setTimes (QTNode<T>* node, double minTime, double maxTime);
+		unsigned bucketSize (QTNode<T>* node) const;
+		unsigned exactSize (QTNode<T>* node) const;
+		vertex	bucketPoint (QTNode<T>* node, unsigned i) const;
+		const T& bucketData (QTNode<T>* node, unsigned i) const;
+		double	bucketTime (QTNode<T>* node, unsigned i) const;
+		int 	bucketFind (QTNode<T>* node, const vertex& v) const;
+		vertex	bucketPush (QTNode<T>* node, const vertex& v, const T& data, double time, const grid_code* code);
+		void	bucketErase (QTNode<T>* node, unsigned i);
+		void	bucketClear (QTNode<T>* node);
+		int 	packedFind (QTNode<T>* node, const grid_code& code, int level) const;
+		bool	distinct (const vector <grid_code>& codes, int level) const;
+		bool	encode (QTNode<T>* node, const vertex& v, grid_code& code, unsigned finer = 0) const;
+		vertex	decode (QTNode<T>* node, const grid_code& code) const;
+		grid_code unpack (QTNode<T>* node, unsigned i) const;
+		grid_code narrow (const grid_code& code) const;
+		bool	widen (const grid_code& code, int dir, grid_code& parent) const;
+		void	aggregate (QTNode<T>* node, const vertex& minXY, const vertex& maxXY, unsigned& count, T& total) const;
+		void	queryLOD (QTNode<T>* node, const vertex& minXY, const vertex& maxXY, long double minCellSize, vector <lod_cell>& cells) const;
+		void 	draw (QTNode<T>* node) const;
+		void 	print (QTNode <T>* node, stringstream& ss) const;
+		void	addAllPointsToResults (QTNode<T>* node, vector <pair <vertex, T> >& results) const;
+		enclosure_status getEnclosureStatus (const vertex& center, const vertex& range, const vertex& minXY, const vertex& maxXY) const;
 
 		QTNode<T>* root;
 		unsigned maxDepth, maxBucketSize;
+		unsigned encodingBits;
+		long double maxError;
+		double	horizon;
+		unsigned long modifications;
+		T identity;
+		function <T (const T&, const T&)> combine;
 };
 
 
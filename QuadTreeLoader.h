@@ -0,0 +1,392 @@
+/**
+	QuadTreeLoader.h
+
+	BoundedQueue: a blocking queue with a fixed capacity, used to hand
+	work between the stages of the loader
+
+	QuadTreeLoader: streams points from a file into a quad tree
+
+	Reading, parsing and inserting run as a pipeline. One thread reads the
+	file in large chunks, a pool of threads parses the chunks into batches
+	and sorts each batch along a Z-order curve so that consecutive inserts
+	land in neighbouring nodes, and the calling thread inserts the batches
+	into the tree (the tree itself is not thread safe). The queues between
+	the stages are bounded, so at most a few chunks and batches are held
+	in memory no matter how large the file is.
+
+	CSV files hold one "x,y" or "x,y,data" point per line, lines that
+	don't start with two numbers are skipped. Binary files hold fixed
+	records of two doubles (x, y) followed by the raw bytes of T, which
+	must be trivially copyable.
+
+	setOnInsert gives a function that is called with each point right
+	after it is inserted, on the calling thread, for callers that need
+	to know exactly which points a load added. The progress function is
+	given a file size of 0 when the input can't be seeked (a pipe).
+
+**/
+
+#ifndef QUADTREELOADER_H
+#define QUADTREELOADER_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "QuadTree.h"
+#include "Vertex.h"
+
+using namespace std;
+
+template <typename X>
+class BoundedQueue
+{
+	public:
+
+		BoundedQueue <X>(unsigned capacity){ this->capacity = capacity; closed = false; }
+
+		// blocks while the queue is full, false (and the item is
+		// dropped) once the queue is closed
+		bool push (X item)
+		{
+			unique_lock <mutex> lock (guard);
+			notFull.wait (lock, [this]{ return items.size() < capacity || closed; });
+			if (closed){
+				return false;
+			}
+			items.push (move (item));
+			notEmpty.notify_one ();
+			return true;
+		}
+
+		// blocks while the queue is empty, false once it is closed and drained
+		bool pop (X& item)
+		{
+			unique_lock <mutex> lock (guard);
+			notEmpty.wait (lock, [this]{ return !items.empty() || closed; });
+			if (items.empty()){
+				return false;
+			}
+			item = move (items.front());
+			items.pop ();
+			notFull.notify_one ();
+			return true;
+		}
+
+		void close ()
+		{
+			lock_guard <mutex> lock (guard);
+			closed = true;
+			notEmpty.notify_all ();
+			notFull.notify_all ();
+		}
+
+	private:
+
+		queue <X> items;
+		unsigned capacity;
+		bool closed;
+		mutex guard;
+		condition_variable notEmpty, notFull;
+};
+
+template <typename T>
+class QuadTreeLoader
+{
+	public:
+
+		QuadTreeLoader <T>(QuadTree<T>* tree, unsigned threads = 0, size_t chunkBytes = 1<<22, unsigned queueDepth = 4);
+
+		void	setProgress (function <void (size_t bytesRead, size_t fileBytes, size_t inserted)> progress);
+		void	setOnInsert (function <void (const vertex& v, const T& data)> onInsert);
+		size_t	loadCSV (const string& path);
+		size_t	loadBinary (const string& path);
+
+	private:
+
+		size_t	load (const string& path, bool csv);
+		void	read (ifstream& file, bool csv, BoundedQueue <string>& chunks);
+		void	parseCSV (const string& chunk, vector <pair <vertex, T> >& batch);
+		void	parseBinary (const string& chunk, vector <pair <vertex, T> >& batch);
+		void	sortBatch (vector <pair <vertex, T> >& batch);
+		static size_t recordSize ();
+		static unsigned spread (unsigned v);
+
+		QuadTree<T>* tree;
+		unsigned threads, queueDepth;
+		size_t	chunkBytes;
+		function <void (size_t, size_t, size_t)> progress;
+		function <void (const vertex&, const T&)> onInsert;
+		atomic <size_t> bytesRead;
+};
+
+template <typename T>
+QuadTreeLoader<T>::QuadTreeLoader (QuadTree<T>* tree, unsigned threads, size_t chunkBytes, unsigned queueDepth)
+{
+	this->tree = tree;
+	// leave one core for the reader and one for the inserting thread
+	if (threads == 0){
+		unsigned cores = thread::hardware_concurrency();
+		threads = (cores > 2) ? cores-2 : 1;
+	}
+	this->threads = threads;
+	this->chunkBytes = chunkBytes;
+	this->queueDepth = (queueDepth > 0) ? queueDepth : 1;
+}
+
+template <typename T>
+void QuadTreeLoader<T>::setProgress (function <void (size_t bytesRead, size_t fileBytes, size_t inserted)> progress)
+{
+	this->progress = progress;
+}
+
+template <typename T>
+void QuadTreeLoader<T>::setOnInsert (function <void (const vertex& v, const T& data)> onInsert)
+{
+	this->onInsert = onInsert;
+}
+
+template <typename T>
+size_t QuadTreeLoader<T>::loadCSV (const string& path)
+{
+	return load (path, true);
+}
+
+template <typename T>
+size_t QuadTreeLoader<T>::loadBinary (const string& path)
+{
+	static_assert (is_trivially_copyable<T>::value, "binary records need a trivially copyable T");
+	return load (path, false);
+}
+
+template <typename T>
+size_t QuadTreeLoader<T>::load (const string& path, bool csv)
+{
+	ifstream file (path.c_str(), ios::in | ios::binary);
+	if (!file){
+		return 0;
+	}
+	// a pipe or other unseekable input has no size, it's reported as 0
+	file.seekg (0, ios::end);
+	streampos end = file.tellg();
+	file.clear ();
+	file.seekg (0, ios::beg);
+	file.clear ();
+	size_t fileBytes = (end == streampos (-1)) ? 0 : (size_t)end;
+	bytesRead = 0;
+
+	BoundedQueue <string> chunks (queueDepth);
+	BoundedQueue <vector <pair <vertex, T> > > batches (queueDepth);
+	atomic <unsigned> running (threads);
+
+	// however load () is left (an insert or a callback may throw), the
+	// queues are closed so that every stage stops, and the threads joined
+	struct Stages{
+		BoundedQueue <string>& chunks;
+		BoundedQueue <vector <pair <vertex, T> > >& batches;
+		thread reader;
+		vector <thread> parsers;
+		~Stages (){
+			chunks.close ();
+			batches.close ();
+			if (reader.joinable()){
+				reader.join ();
+			}
+			for (unsigned i=0; i < parsers.size(); ++i){
+				parsers[i].join ();
+			}
+		}
+	} stages = {chunks, batches};
+
+	// reader stage
+	stages.reader = thread ([&]{ read (file, csv, chunks); });
+
+	// parser stage, the last parser to finish closes the batch queue
+	for (unsigned i=0; i < threads; ++i){
+		stages.parsers.push_back (thread ([&]{
+			string chunk;
+			while (chunks.pop (chunk)){
+				vector <pair <vertex, T> > batch;
+				if (csv){
+					parseCSV (chunk, batch);
+				}
+				else{
+					parseBinary (chunk, batch);
+				}
+				sortBatch (batch);
+				if (!batches.push (move (batch))){
+					break;
+				}
+			}
+			if (--running == 0){
+				batches.close ();
+			}
+		}));
+	}
+
+	// insert stage, runs on the calling thread
+	size_t inserted = 0;
+	vector <pair <vertex, T> > batch;
+	while (batches.pop (batch)){
+		for (int i=0; i < batch.size(); ++i){
+			tree->insert (batch[i].first, batch[i].second);
+			if (onInsert){
+				onInsert (batch[i].first, batch[i].second);
+			}
+		}
+		inserted += batch.size();
+		if (progress){
+			progress (bytesRead, fileBytes, inserted);
+		}
+	}
+	return inserted;
+}
+
+template <typename T>
+void QuadTreeLoader<T>::read (ifstream& file, bool csv, BoundedQueue <string>& chunks)
+{
+	// binary chunks hold whole records, csv chunks end on a line break
+	// and the partial line after it starts the next chunk
+	size_t size = csv ? chunkBytes : max (chunkBytes - chunkBytes % recordSize(), recordSize());
+	string carry;
+
+	while (file){
+		string chunk (carry);
+		size_t start = chunk.size();
+		chunk.resize (start + size);
+		file.read (&chunk[start], size);
+		size_t got = file.gcount();
+		chunk.resize (start + got);
+		bytesRead += got;
+		carry.clear();
+
+		if (csv && file){
+			size_t end = chunk.rfind ('\n');
+			if (end != string::npos){
+				carry = chunk.substr (end+1);
+				chunk.resize (end+1);
+			}
+			else{
+				// a single line longer than the chunk, keep reading it
+				carry.swap (chunk);
+				continue;
+			}
+		}
+		if (!chunk.empty() && !chunks.push (move (chunk))){
+			break;
+		}
+	}
+	chunks.close ();
+}
+
+template <typename T>
+void QuadTreeLoader<T>::parseCSV (const string& chunk, vector <pair <vertex, T> >& batch)
+{
+	const char* p = chunk.c_str();
+	const char* end = p + chunk.size();
+
+	while (p < end){
+		const char* eol = (const char*)memchr (p, '\n', end-p);
+		if (!eol){
+			eol = end;
+		}
+		// strtold skips leading white space, newlines included, so a
+		// number is only taken if it ends on this line
+		char* next;
+		long double x = strtold (p, &next);
+		if (next != p && next < eol && *next == ','){
+			p = next+1;
+			long double y = strtold (p, &next);
+			if (next != p && next <= eol){
+				T data = T();
+				if (*next == ','){
+					istringstream field (string ((const char*)next+1, eol));
+					field >> data;
+				}
+				batch.push_back ({vertex (x, y), data});
+			}
+		}
+		p = eol+1;
+	}
+}
+
+template <typename T>
+void QuadTreeLoader<T>::parseBinary (const string& chunk, vector <pair <vertex, T> >& batch)
+{
+	const char* p = chunk.data();
+	size_t records = chunk.size() / recordSize();
+	batch.reserve (records);
+
+	for (size_t i=0; i < records; ++i, p += recordSize()){
+		double x, y;
+		T data;
+		memcpy (&x, p, sizeof(double));
+		memcpy (&y, p + sizeof(double), sizeof(double));
+		memcpy (&data, p + 2*sizeof(double), sizeof(T));
+		batch.push_back ({vertex (x, y), data});
+	}
+}
+
+template <typename T>
+void QuadTreeLoader<T>::sortBatch (vector <pair <vertex, T> >& batch)
+{
+	if (batch.empty()){
+		return;
+	}
+	vertex lo = batch[0].first, hi = batch[0].first;
+	for (int i=1; i < batch.size(); ++i){
+		lo.x = min (lo.x, batch[i].first.x);
+		lo.y = min (lo.y, batch[i].first.y);
+		hi.x = max (hi.x, batch[i].first.x);
+		hi.y = max (hi.y, batch[i].first.y);
+	}
+	long double sx = (hi.x > lo.x) ? 65535.0/(hi.x-lo.x) : 0;
+	long double sy = (hi.y > lo.y) ? 65535.0/(hi.y-lo.y) : 0;
+
+	// interleave 16 bit cell coordinates into a Z-order key
+	vector <pair <unsigned, unsigned> > keys (batch.size());
+	for (int i=0; i < batch.size(); ++i){
+		unsigned cx = (batch[i].first.x - lo.x) * sx;
+		unsigned cy = (batch[i].first.y - lo.y) * sy;
+		keys[i] = {(spread (cx) << 1) | spread (cy), i};
+	}
+	sort (keys.begin(), keys.end());
+
+	vector <pair <vertex, T> > sorted;
+	sorted.reserve (batch.size());
+	for (int i=0; i < keys.size(); ++i){
+		sorted.push_back (batch[keys[i].second]);
+	}
+	batch.swap (sorted);
+}
+
+template <typename T>
+size_t QuadTreeLoader<T>::recordSize ()
+{
+	return 2*sizeof(double) + sizeof(T);
+}
+
+template <typename T>
+unsigned QuadTreeLoader<T>::spread (unsigned v)
+{
+	// put a zero bit between each of the low 16 bits of v
+	v &= 0x0000ffff;
+	v = (v | (v << 8)) & 0x00ff00ff;
+	v = (v | (v << 4)) & 0x0f0f0f0f;
+	v = (v | (v << 2)) & 0x33333333;
+	v = (v | (v << 1)) & 0x55555555;
+	return v;
+}
+
+#endif //#ifdef QUADTREELOADER_H
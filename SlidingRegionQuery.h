@@ -0,0 +1,144 @@
+/**
+	SlidingRegionQuery.h
+
+	SlidingRegionQuery: an incremental region search for a selection box
+	that moves in small steps. The previous box and its results are kept,
+	and on each move only the strips of the new box that were not covered
+	by the old one are searched in the tree. Results that fall outside the
+	new box are dropped from the kept set and reported as removed.
+
+	The kept results are only valid while the tree is unchanged. The
+	tree's version is checked on each move, and a move after the tree was
+	changed runs a full search. invalidate () forces one as well.
+
+**/
+
+#ifndef SLIDINGREGIONQUERY_H
+#define SLIDINGREGIONQUERY_H
+
+#include <vector>
+
+#include "QuadTree.h"
+#include "Vertex.h"
+
+using namespace std;
+
+template <typename T>
+class SlidingRegionQuery
+{
+	public:
+
+		SlidingRegionQuery <T>(const QuadTree<T>* tree);
+
+		void	reset (vertex minXY, vertex maxXY);
+		void	move (vertex minXY, vertex maxXY, vector <pair <vertex, T> >& added, vector <pair <vertex, T> >& removed);
+		void	invalidate ();
+		void	clear ();
+		const vector <pair <vertex, T> >& results ();
+
+	private:
+
+		void	addRegion (const vertex& minXY, const vertex& maxXY, vector <pair <vertex, T> >& added);
+
+		const QuadTree<T>* tree;
+		vector <pair <vertex, T> > found;
+		vertex	boxMin, boxMax;
+		bool	stale;
+		unsigned long seen;
+};
+
+template <typename T>
+SlidingRegionQuery<T>::SlidingRegionQuery (const QuadTree<T>* tree)
+{
+	this->tree = tree;
+	stale = true;
+}
+
+template <typename T>
+void SlidingRegionQuery<T>::reset (vertex minXY, vertex maxXY)
+{
+	found = tree->getObjectsInRegion (minXY, maxXY);
+	boxMin = minXY;
+	boxMax = maxXY;
+	stale = false;
+	seen = tree->version();
+}
+
+template <typename T>
+void SlidingRegionQuery<T>::move (vertex minXY, vertex maxXY, vector <pair <vertex, T> >& added, vector <pair <vertex, T> >& removed)
+{
+	added.clear();
+	removed.clear();
+
+	// the boxes don't overlap (or the kept results can't be trusted),
+	// so there is nothing to reuse and everything is replaced
+	if (stale || seen != tree->version() || minXY.x >= boxMax.x || maxXY.x <= boxMin.x ||
+				 minXY.y >= boxMax.y || maxXY.y <= boxMin.y){
+		removed.swap (found);
+		reset (minXY, maxXY);
+		added = found;
+		return;
+	}
+
+	// drop kept results that the new box no longer covers
+	int kept = 0;
+	for (int i=0; i < found.size(); ++i){
+		if (pointInRegion (found[i].first, minXY, maxXY)){
+			found[kept++] = found[i];
+		}
+		else{
+			removed.push_back (found[i]);
+		}
+	}
+	found.resize (kept);
+
+	// search the strips of the new box that the old box did not cover,
+	// the left and right strips span the full height of the new box and
+	// the bottom and top strips fill in the columns between them
+	if (minXY.x < boxMin.x){
+		addRegion (minXY, {boxMin.x, maxXY.y}, added);
+	}
+	if (maxXY.x > boxMax.x){
+		addRegion ({boxMax.x, minXY.y}, maxXY, added);
+	}
+	long double innerMinX = (minXY.x > boxMin.x) ? minXY.x : boxMin.x;
+	long double innerMaxX = (maxXY.x < boxMax.x) ? maxXY.x : boxMax.x;
+	if (minXY.y < boxMin.y){
+		addRegion ({innerMinX, minXY.y}, {innerMaxX, boxMin.y}, added);
+	}
+	if (maxXY.y > boxMax.y){
+		addRegion ({innerMinX, boxMax.y}, {innerMaxX, maxXY.y}, added);
+	}
+	found.insert (found.end(), added.begin(), added.end());
+
+	boxMin = minXY;
+	boxMax = maxXY;
+}
+
+template <typename T>
+void SlidingRegionQuery<T>::invalidate ()
+{
+	stale = true;
+}
+
+template <typename T>
+void SlidingRegionQuery<T>::clear ()
+{
+	found.clear();
+	stale = true;
+}
+
+template <typename T>
+const vector <pair <vertex, T> >& SlidingRegionQuery<T>::results ()
+{
+	return found;
+}
+
+template <typename T>
+void SlidingRegionQuery<T>::addRegion (const vertex& minXY, const vertex& maxXY, vector <pair <vertex, T> >& added)
+{
+	vector <pair <vertex, T> > strip = tree->getObjectsInRegion (minXY, maxXY);
+	added.insert (added.end(), strip.begin(), strip.end());
+}
+
+#endif //#ifdef SLIDINGREGIONQUERY_H
@@ -1,4 +1,6 @@
 #include "QuadTree.h"
+#include "QuadTreeLoader.h"
+#include "SlidingRegionQuery.h"
 #include <algorithm>
 #include <cmath>
 #include <ctime>
@@ -30,9 +32,10 @@ float pixToYCoord = graphYRange/height;
 
 static bool leftMouseDown = 0;
 static bool rightMouseDown = 0;
+static bool lodView = 0;
+static double LOD_CELL_PIXELS = 8.0;
 
-vector <vertex> targetPoint;
-vector <vertex> foundPoint;
+vector <pair <vertex, int> > targetPoint;
 
 vertex squareCenter (0, 0);
 vertex squareRange (10, 10);
@@ -41,6 +44,7 @@ vertex origin (0, 0);
 vertex axis (128.0, 128.0);
 static int bucketSize = 1;
 QuadTree <int>* qtree;
+SlidingRegionQuery <int>* selection;
 
 bool going (false);
 
@@ -103,17 +107,19 @@ long double randomFloat (){
 
 static void findPoints ()
 {
-  vector <pair <vertex, int> > found;
-  found = qtree->getObjectsInRegion (
+  selection->reset (
       {squareCenter.x-squareRange.x, squareCenter.y-squareRange.y}, 
       {squareCenter.x+squareRange.x, squareCenter.y+squareRange.y});
+}
 
-  foundPoint.clear();
-  foundPoint.resize(found.size());
-
-  for (int i=0; i < found.size(); ++i){
-      foundPoint[i] = found[i].first;
-  }
+static void moveSelection ()
+{
+  // only the strips the box slid over are searched in the tree
+  vector <pair <vertex, int> > added, removed;
+  selection->move (
+      {squareCenter.x-squareRange.x, squareCenter.y-squareRange.y}, 
+      {squareCenter.x+squareRange.x, squareCenter.y+squareRange.y},
+      added, removed);
 }
 
 static void display(void)
@@ -121,7 +127,30 @@ static void display(void)
     glClear (GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
     glColor3f (1, 1, 1);
     
-    qtree->draw(); 
+    if (lodView){
+        // one summary cell per node at about screen resolution,
+        // however many points are in view
+        vector <lod_cell> cells = qtree->queryLOD (
+            {graphXMin, graphYMin}, {graphXMax, graphYMax}, LOD_CELL_PIXELS*pixToXCoord);
+        for (unsigned i=0; i<cells.size(); ++i){
+            glBegin (GL_LINE_LOOP);
+                glVertex2f (cells[i].center.x-cells[i].range.x, cells[i].center.y-cells[i].range.y);
+                glVertex2f (cells[i].center.x-cells[i].range.x, cells[i].center.y+cells[i].range.y);
+                glVertex2f (cells[i].center.x+cells[i].range.x, cells[i].center.y+cells[i].range.y);
+                glVertex2f (cells[i].center.x+cells[i].range.x, cells[i].center.y-cells[i].range.y);
+            glEnd();
+        }
+        glColor3f (0, 0, 1);
+        glPointSize (3.0);
+        glBegin (GL_POINTS);
+            for (unsigned i=0; i<cells.size(); ++i){
+                glVertex2f (cells[i].centroid.x, cells[i].centroid.y);
+            }
+        glEnd();
+    }
+    else{
+        qtree->draw(); 
+    }
 
     /*
     // target points 
@@ -129,7 +158,7 @@ static void display(void)
     glPointSize (3.0);
     glBegin (GL_POINTS);
         for (unsigned i=0; i<targetPoint.size(); ++i){
-            glVertex2f (targetPoint[i].x, targetPoint[i].y);
+            glVertex2f (targetPoint[i].first.x, targetPoint[i].first.y);
         }
     glEnd();
     */
@@ -143,11 +172,12 @@ static void display(void)
     glEnd();
 
     // found points 
+    const vector <pair <vertex, int> >& foundPoint = selection->results();
     glColor3f (0, 1, 0);
     glPointSize (3.0);
     glBegin (GL_POINTS);
         for (unsigned i=0; i<foundPoint.size(); ++i){
-            glVertex2f (foundPoint[i].x, foundPoint[i].y);
+            glVertex2f (foundPoint[i].first.x, foundPoint[i].first.y);
         }
     glEnd();
 
@@ -161,16 +191,16 @@ static void key(unsigned char key, int x, int y)
         case 'c':
         case 'C':
             for (int i=0; i < targetPoint.size(); ++i){
-                qtree->remove (targetPoint[i]);
+                qtree->remove (targetPoint[i].first);
             }
             targetPoint.clear();
         break;
 
         case 'k':
-            for (int i=0; i < foundPoint.size(); ++i){
-                qtree->remove (foundPoint[i]);
+            for (int i=0; i < selection->results().size(); ++i){
+                qtree->remove (selection->results()[i].first);
             }
-            foundPoint.clear();
+            selection->clear();
         break;
 
         case 'p':
@@ -203,7 +233,7 @@ static void key(unsigned char key, int x, int y)
             for (int i=0; i < 100; ++i){
                 vertex newpoint (  axis.x - ( 2 * axis.x * randomFloat()),
                                    axis.y - ( 2 * axis.y * randomFloat()));
-                targetPoint.push_back(newpoint);
+                targetPoint.push_back({newpoint, 1});
                 qtree->insert (newpoint, 1);
             }
         break;
@@ -213,8 +243,10 @@ static void key(unsigned char key, int x, int y)
             bucketSize--;
             qtree = new QuadTree <int> (origin, axis, bucketSize);
             for (int i=0; i < targetPoint.size(); ++i){
-                qtree->insert (targetPoint[i], 1);
+                qtree->insert (targetPoint[i].first, targetPoint[i].second);
             }
+            delete selection;
+            selection = new SlidingRegionQuery <int> (qtree);
         break;
 
         case 'B':
@@ -222,15 +254,18 @@ static void key(unsigned char key, int x, int y)
             bucketSize++;
             qtree = new QuadTree <int> (origin, axis, bucketSize);
             for (int i=0; i < targetPoint.size(); ++i){
-                qtree->insert (targetPoint[i], 1);
+                qtree->insert (targetPoint[i].first, targetPoint[i].second);
             }
+            delete selection;
+            selection = new SlidingRegionQuery <int> (qtree);
         break;
 
         case '~':
             delete qtree;
             qtree = new QuadTree <int> (origin, axis, bucketSize);
+            delete selection;
+            selection = new SlidingRegionQuery <int> (qtree);
             targetPoint.clear ();
-            foundPoint.clear ();            
         break;
 
         case '+':
@@ -246,6 +281,11 @@ static void key(unsigned char key, int x, int y)
         case 'f':
             findPoints ();
         break;
+
+        case 'l':
+        case 'L':
+            lodView = !lodView;
+        break;
     }
     glutPostRedisplay();
 }
@@ -259,7 +299,7 @@ static void mouse (int button, int state, int x, int y)
             switch (state){
                 case GLUT_DOWN:
                     leftMouseDown = 1;
-                    targetPoint.push_back(newpoint);
+                    targetPoint.push_back({newpoint, 1});
                     qtree->insert (newpoint, 1);
                 break;
 
@@ -291,22 +331,54 @@ static void motion (int x, int y)
                       -y*pixToYCoord + graphYMax);
 
     if (leftMouseDown){
-    	targetPoint.push_back(newpoint);
+    	targetPoint.push_back({newpoint, 1});
     	qtree->insert (newpoint, 1);
     }
     else if (rightMouseDown){
     	squareCenter = newpoint;
-    	findPoints ();
+    	moveSelection ();
     }
     
     glutPostRedisplay();
 }
 
+static void loadPoints (const string& path)
+{
+    QuadTreeLoader <int> loader (qtree);
+    // keep the loaded points with the user's so the tree can be rebuilt
+    loader.setOnInsert ([](const vertex& v, const int& data){
+        targetPoint.push_back ({v, data});
+    });
+    loader.setProgress ([&](size_t bytesRead, size_t fileBytes, size_t inserted){
+        cout << '\r' << path << ": " << bytesRead;
+        if (fileBytes > 0){
+            cout << '/' << fileBytes;
+        }
+        cout << " bytes, " << inserted << " points" << flush;
+    });
+
+    // files ending in .csv are text, anything else is binary records
+    size_t dot = path.rfind ('.');
+    if (dot != string::npos && path.substr (dot) == ".csv"){
+        loader.loadCSV (path);
+    }
+    else{
+        loader.loadBinary (path);
+    }
+    cout << endl;
+}
+
 int main(int argc, char *argv[])
 {
     srand (time (0));
     qtree = new QuadTree <int> (origin, axis, 1);
+    selection = new SlidingRegionQuery <int> (qtree);
     glutInit(&argc, argv);
+
+    // any arguments glut didn't take are point files to load
+    for (int i=1; i < argc; ++i){
+        loadPoints (argv[i]);
+    }
     glutInitWindowSize(width,height);
     glutInitWindowPosition(10,10);
     glutInitDisplayMode(GLUT_RGB | GLUT_DOUBLE | GLUT_DEPTH);